@@ -2,8 +2,25 @@
 #include <windows.h>
 #include <strsafe.h>
 #include <wchar.h>
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <span>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <version>
+#if __cpp_lib_mdspan
+#include <mdspan>
+#endif
+#include <vector>
+#include <algorithm>
 #include <functional>
 #include <type_traits>
 #include "xlcall.h"
@@ -32,6 +49,9 @@ struct CXLOPER12 : XLOPER12 {
   static CXLOPER12 nullop;
   static inline XLREF12 nullref;
   static inline std::atomic_int alloc = -1; // do not count nullop
+#ifdef XLLUTL_COUNT_ALLOCS
+  static inline std::atomic<uint64_t> allocs = 0; // buffers malloc'ed or adopted, never decremented
+#endif
   
   CXLOPER12() {
     xltype = xltypeNil;
@@ -68,25 +88,46 @@ struct CXLOPER12 : XLOPER12 {
     size_t bytes;
     StringCbLengthA(str,STRSAFE_MAX_CCH * sizeof(TCHAR),&bytes);
     auto wlen= MultiByteToWideChar(CP_ACP,MB_ERR_INVALID_CHARS,str,bytes,nullptr,0);
-    val.str = (XCHAR*)std::malloc(sizeof(wchar_t)*(wlen+1));
+    val.str = (XCHAR*)allocate(sizeof(wchar_t)*(wlen+1));
     val.str[0] = wlen;
     MultiByteToWideChar(CP_ACP,MB_ERR_INVALID_CHARS,str,bytes,val.str+1,wlen);
     alloc++;
   }
   CXLOPER12(const wchar_t *str) {
     xltype = xltypeStr;
-    auto len = lstrlenW(str);
-    val.str = (XCHAR*)std::malloc(sizeof(wchar_t)*(len+1));
-    val.str[0] = len;
-    wmemcpy_s(val.str+1, len, str, len);
+    val.str = counted(str,lstrlenW(str));
     alloc++;
   } 
+  CXLOPER12(std::wstring_view str) {
+    xltype = xltypeStr;
+    val.str = counted(str.data(),str.size());
+    alloc++;
+  }
+  // take ownership of a std::malloc'ed counted string
+  static CXLOPER12 adopt(XCHAR *str) {
+#ifdef XLLUTL_COUNT_ALLOCS
+    allocs.fetch_add(1,std::memory_order_relaxed);
+#endif
+    CXLOPER12 ret;
+    ret.xltype = xltypeStr;
+    ret.val.str = str;
+    return ret;
+  }
+  // non-owning views over xltypeStr, empty for other types
+  std::wstring_view view() {
+    return isStr() && val.str ? std::wstring_view(val.str+1,val.str[0]) : std::wstring_view();
+  }
+  std::u16string_view u16view() {
+    static_assert(sizeof(XCHAR)==sizeof(char16_t));
+    auto v = view();
+    return std::u16string_view((const char16_t*)v.data(),v.size());
+  }
   // xltypeMulti
   CXLOPER12(RW r, COL c) {
     xltype = xltypeMulti;
     val.array.rows = r;
     val.array.columns = c;
-    val.array.lparray = (LPXLOPER12)std::malloc(sizeof(CXLOPER12)*r*c);
+    val.array.lparray = (LPXLOPER12)allocate(sizeof(CXLOPER12)*r*c);
     for(unsigned i=0 ; i<r*c; i++) {
       val.array.lparray[i].xltype = xltypeNil;
       alloc++;
@@ -94,6 +135,63 @@ struct CXLOPER12 : XLOPER12 {
     alloc++;
   }
   
+  /*
+  column vectors, one allocation for the array, one per string, 
+  each cell is written once. empty input gives #N/A, as Excel has no 
+  empty Multi, more rows than RW holds gives #NUM!.
+  */
+  CXLOPER12(std::span<const double> v) {
+    alloc++;
+    if (!uninit(v.size(),1)) return;
+    for(size_t i=0; i<v.size(); i++) {
+      val.array.lparray[i].xltype = xltypeNum;
+      val.array.lparray[i].val.num = v[i];
+    }
+  }
+  CXLOPER12(std::vector<std::wstring> const &v) {
+    alloc++;
+    if (!uninit(v.size(),1)) return;
+    for(size_t i=0; i<v.size(); i++) {
+      val.array.lparray[i].xltype = xltypeStr;
+      val.array.lparray[i].val.str = counted(v[i].data(),v[i].size());
+    }
+  }
+#if __cpp_lib_mdspan
+  // any 2d layout of numbers or strings, read with m[r,c] so strided views work as is
+  template<typename T, typename E, typename L, typename A>
+  requires (E::rank() == 2)
+  CXLOPER12(std::mdspan<T,E,L,A> m) {
+    alloc++;
+    if (!uninit(m.extent(0),m.extent(1))) return;
+    for(size_t r=0; r<m.extent(0); r++) {
+      for(size_t c=0; c<m.extent(1); c++) {
+        auto &cell = val.array.lparray[r*m.extent(1)+c];
+        if constexpr (std::is_convertible_v<T&,std::wstring_view>) {
+          std::wstring_view str = m[r,c];
+          cell.xltype = xltypeStr;
+          cell.val.str = counted(str.data(),str.size());
+        } else {
+          cell.xltype = xltypeNum;
+          cell.val.num = (double)m[r,c];
+        }
+      }
+    }
+  }
+#endif
+  // take ownership of std::malloc'ed cells, which must be valid CXLOPER12
+  static CXLOPER12 adopt(LPXLOPER12 cells, RW r, COL c) {
+#ifdef XLLUTL_COUNT_ALLOCS
+    allocs.fetch_add(1,std::memory_order_relaxed);
+#endif
+    CXLOPER12 ret;
+    ret.xltype = xltypeMulti;
+    ret.val.array.rows = r;
+    ret.val.array.columns = c;
+    ret.val.array.lparray = cells;
+    alloc += r*c;
+    return ret;
+  }
+  
   CXLOPER12& at(RW r, COL c) {
     if (!isMulti() || r<1 || c<1 || r>val.array.rows || c>val.array.columns) {
       return (CXLOPER12&)nullop;
@@ -125,7 +223,7 @@ struct CXLOPER12 : XLOPER12 {
     xltype = xltypeRef;
     val.mref.idSheet = sht;
     auto bytes = sizeof(XLREF12)*N;
-    auto lpmref = (XLMREF12*)std::malloc(bytes+sizeof(WORD));
+    auto lpmref = (XLMREF12*)allocate(bytes+sizeof(WORD));
     lpmref->count = N;
     memcpy(lpmref->reftbl,refs.data(),bytes);
     val.mref.lpmref = lpmref;
@@ -166,9 +264,26 @@ struct CXLOPER12 : XLOPER12 {
     move(op);
     return*this;
   }
+  /*
+  std::malloc for buffers myfree releases. with XLLUTL_COUNT_ALLOCS defined 
+  each call is counted in allocs, otherwise it costs nothing extra.
+  */
+  static void* allocate(size_t bytes) {
+#ifdef XLLUTL_COUNT_ALLOCS
+    allocs.fetch_add(1,std::memory_order_relaxed);
+#endif
+    return std::malloc(bytes);
+  }
   static CXLOPER12& attach(LPXLOPER12 op) {
     return (CXLOPER12&)*op;
   }
+  // the reverse of adopt, the caller owns the buffers from now on and frees them with std::free
+  XLOPER12 release() {
+    XLOPER12 ret = *this;
+    if (isMulti()) alloc -= val.array.rows*val.array.columns;
+    xltype = xltypeNil;
+    return ret;
+  }
   const char* type() {
     switch(xltype & 0xFFF) {
       case xltypeInt: {
@@ -293,7 +408,6 @@ struct CXLOPER12 : XLOPER12 {
   ~CXLOPER12() {
     myfree();
     alloc--;
-    printf("~\n");
   }
   void dFree(bool flag) {
     if (flag) {
@@ -311,6 +425,7 @@ struct CXLOPER12 : XLOPER12 {
     }
   }
 private:
+  friend struct xlarray;
   /*
   why setup myfree
     if an UDF
@@ -349,6 +464,38 @@ private:
     }
   }
   
+  /*
+  Multi with cells left for the caller to fill or move in, the cells are 
+  counted in alloc, the object itself is counted by its constructor.
+  #N/A / #NUM! if r x c can't be a Multi.
+  */
+  bool uninit(size_t r, size_t c) {
+    if (!r || !c) {
+      xltype = xltypeErr;
+      val.err = xlerrNA;
+      return false;
+    }
+    if (r > (size_t)std::numeric_limits<RW>::max() || c > (size_t)std::numeric_limits<COL>::max()) {
+      xltype = xltypeErr;
+      val.err = xlerrNum;
+      return false;
+    }
+    xltype = xltypeMulti;
+    val.array.rows = (RW)r;
+    val.array.columns = (COL)c;
+    val.array.lparray = (LPXLOPER12)allocate(sizeof(XLOPER12)*r*c);
+    alloc += r*c;
+    return true;
+  }
+  // counted string, truncated to the 32767 characters Excel allows
+  static XCHAR* counted(const wchar_t *str, size_t len) {
+    len = std::min<size_t>(len,32767);
+    auto ret = (XCHAR*)allocate(sizeof(XCHAR)*(len+1));
+    ret[0] = (XCHAR)len;
+    wmemcpy(ret+1,str,len);
+    return ret;
+  }
+  
   void move(CXLOPER12 &px) {
     memcpy(this,&px,sizeof(CXLOPER12));
     if(isStr()) {
@@ -369,13 +516,252 @@ private:
 
 static_assert(sizeof(CXLOPER12)==sizeof(XLOPER12));
 
+/*
+recalc trace recorder
+  logs every xl12 callback and every UDF call marked with xltrace::udf 
+  to a binary file, xlreplay.cpp runs the log against the XLL outside Excel.
+  
+  record   : u8 kind, u32 bytes of the rest, u64 ns since open
+  EXCEL    : i32 xlfn, i32 return code, u16 argc, args, result
+  UDF      : u16 name length, name, u16 argc, args
+  value    : u16 xltype, then Num f64 | Int i32 | Bool u8 | Err i32 |
+             Str u16 count, utf16 | Multi i32 rows, i32 cols, cells |
+             SRef XLREF12 | Ref u64 sheet, u16 count, XLREF12s
+  Flow and BigData are logged as Nil.
+  
+  to report allocations per call, build the XLL with XLLUTL_COUNT_ALLOCS 
+  defined, it then exports xlTraceAlloc returning CXLOPER12::allocs.
+*/
+struct xltrace {
+  enum kind : uint8_t {
+    EXCEL = 1,
+    UDF = 2,
+  };
+  static inline std::atomic_bool active = false;
+  
+  static bool open(const char *path) {
+    std::lock_guard guard(lock);
+    if (file) fclose(file);
+    file = fopen(path,"wb");
+    start = std::chrono::steady_clock::now();
+    active = file != nullptr;
+    return active;
+  }
+  static void close() {
+    std::lock_guard guard(lock);
+    active = false;
+    if (file) fclose(file);
+    file = nullptr;
+  }
+  // call first thing in a UDF, name is the exported name
+  template<typename ... ARGS>
+  requires std::conjunction_v<std::is_same<ARGS,LPXLOPER12>...>
+  static void udf(const char *name, ARGS ... args) {
+    if (!active) return;
+    std::string buf;
+    put<uint16_t>(buf,strlen(name));
+    buf.append(name);
+    put<uint16_t>(buf,sizeof ... (ARGS));
+    (write(buf,args), ...);
+    emit(UDF,buf);
+  }
+  static void callback(int xlfn, int ret, int count, LPXLOPER12 *args, LPXLOPER12 res) {
+    if (!active) return;
+    std::string buf;
+    put<int32_t>(buf,xlfn);
+    put<int32_t>(buf,ret);
+    put<uint16_t>(buf,count);
+    for(int i=0; i<count; i++) write(buf,args[i]);
+    write(buf,res);
+    emit(EXCEL,buf);
+  }
+  
+  static void write(std::string &buf, XLOPER12 *op) {
+    uint16_t type = op ? op->xltype & 0xFFF : xltypeMissing;
+    if (type == xltypeFlow || type == xltypeBigData) type = xltypeNil;
+    if (type == xltypeStr && !op->val.str) type = xltypeNil;
+    put<uint16_t>(buf,type);
+    switch(type) {
+      case xltypeNum: {
+        put<double>(buf,op->val.num);
+        break;
+      }
+      case xltypeInt: {
+        put<int32_t>(buf,op->val.w);
+        break;
+      }
+      case xltypeBool: {
+        put<uint8_t>(buf,op->val.xbool ? 1 : 0);
+        break;
+      }
+      case xltypeErr: {
+        put<int32_t>(buf,op->val.err);
+        break;
+      }
+      case xltypeStr: {
+        buf.append((const char*)op->val.str,sizeof(XCHAR)*(1+(uint16_t)op->val.str[0]));
+        break;
+      }
+      case xltypeMulti: {
+        put<int32_t>(buf,op->val.array.rows);
+        put<int32_t>(buf,op->val.array.columns);
+        for(size_t i=0; i<(size_t)op->val.array.rows*op->val.array.columns; i++) {
+          write(buf,&op->val.array.lparray[i]);
+        }
+        break;
+      }
+      case xltypeSRef: {
+        put<XLREF12>(buf,op->val.sref.ref);
+        break;
+      }
+      case xltypeRef: {
+        uint16_t count = op->val.mref.lpmref ? op->val.mref.lpmref->count : 0;
+        put<uint64_t>(buf,op->val.mref.idSheet);
+        put<uint16_t>(buf,count);
+        if (count) buf.append((const char*)op->val.mref.lpmref->reftbl,sizeof(XLREF12)*count);
+        break;
+      }
+    }
+  }
+  static CXLOPER12 read(const char *&p) {
+    auto type = get<uint16_t>(p);
+    switch(type) {
+      case xltypeNum: {
+        return CXLOPER12(get<double>(p));
+      }
+      case xltypeInt: {
+        return CXLOPER12((int)get<int32_t>(p));
+      }
+      case xltypeBool: {
+        return CXLOPER12(get<uint8_t>(p) != 0);
+      }
+      case xltypeErr: {
+        return CXLOPER12((xltypeErrEx)get<int32_t>(p));
+      }
+      case xltypeMissing: {
+        return CXLOPER12(xltypeErrEx::MISSING);
+      }
+      case xltypeStr: {
+        auto len = get<uint16_t>(p);
+        auto str = (XCHAR*)std::malloc(sizeof(XCHAR)*(len+1));
+        str[0] = len;
+        memcpy(str+1,p,sizeof(XCHAR)*len);
+        p += sizeof(XCHAR)*len;
+        return CXLOPER12::adopt(str);
+      }
+      case xltypeMulti: {
+        RW rows = get<int32_t>(p);
+        COL cols = get<int32_t>(p);
+        CXLOPER12 ret(rows,cols);
+        for(RW r=1; r<=rows; r++) {
+          for(COL c=1; c<=cols; c++) ret.at(r,c) = read(p);
+        }
+        return ret;
+      }
+      case xltypeSRef: {
+        return CXLOPER12(get<XLREF12>(p));
+      }
+      case xltypeRef: {
+        CXLOPER12 ret;
+        auto sheet = get<uint64_t>(p);
+        auto count = get<uint16_t>(p);
+        auto lpmref = (XLMREF12*)CXLOPER12::allocate(sizeof(XLMREF12)+sizeof(XLREF12)*count);
+        lpmref->count = count;
+        memcpy(lpmref->reftbl,p,sizeof(XLREF12)*count);
+        p += sizeof(XLREF12)*count;
+        ret.xltype = xltypeRef;
+        ret.val.mref.idSheet = (IDSHEET)sheet;
+        ret.val.mref.lpmref = lpmref;
+        return ret;
+      }
+      default: {
+        return CXLOPER12();
+      }
+    }
+  }
+  // advance past a value without building it, false if it runs past end
+  static bool skip(const char *&p, const char *end) {
+    auto need = [&](size_t bytes) {
+      if ((size_t)(end-p) < bytes) return false;
+      p += bytes;
+      return true;
+    };
+    auto at = p;
+    if (!need(sizeof(uint16_t))) return false;
+    switch(get<uint16_t>(at)) {
+      case xltypeNum: return need(sizeof(double));
+      case xltypeInt: return need(sizeof(int32_t));
+      case xltypeBool: return need(sizeof(uint8_t));
+      case xltypeErr: return need(sizeof(int32_t));
+      case xltypeStr: {
+        if (!need(sizeof(uint16_t))) return false;
+        return need(sizeof(XCHAR)*get<uint16_t>(at));
+      }
+      case xltypeMulti: {
+        if (!need(2*sizeof(int32_t))) return false;
+        auto rows = get<int32_t>(at), cols = get<int32_t>(at);
+        if (rows < 0 || cols < 0) return false;
+        for(size_t i=0; i<(size_t)rows*cols; i++) {
+          if (!skip(p,end)) return false;
+        }
+        return true;
+      }
+      case xltypeSRef: return need(sizeof(XLREF12));
+      case xltypeRef: {
+        if (!need(sizeof(uint64_t)+sizeof(uint16_t))) return false;
+        at += sizeof(uint64_t);
+        return need(sizeof(XLREF12)*get<uint16_t>(at));
+      }
+      default: return true;
+    }
+  }
+  template<typename T>
+  static void put(std::string &buf, T v) {
+    buf.append((const char*)&v,sizeof(T));
+  }
+  template<typename T>
+  static T get(const char *&p) {
+    T v;
+    memcpy(&v,p,sizeof(T));
+    p += sizeof(T);
+    return v;
+  }
+private:
+  static void emit(kind k, std::string const &body) {
+    std::lock_guard guard(lock);
+    if (!file) return;
+    // stamped under the lock so records are in time order in the file
+    uint64_t t = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start).count();
+    std::string head;
+    put<uint8_t>(head,k);
+    put<uint32_t>(head,sizeof(t)+body.size());
+    put<uint64_t>(head,t);
+    fwrite(head.data(),1,head.size(),file);
+    fwrite(body.data(),1,body.size(),file);
+  }
+  static inline std::mutex lock;
+  static inline FILE *file = nullptr;
+  static inline std::chrono::steady_clock::time_point start;
+};
+
+#ifdef XLLUTL_COUNT_ALLOCS
+extern "C" __declspec(dllexport) inline uint64_t xlTraceAlloc() {
+  return CXLOPER12::allocs;
+}
+#endif
+
 template<typename ... ARGS>
 requires std::conjunction_v<std::is_same<ARGS,LPXLOPER12>...>
 [[nodiscard]]
 CXLOPER12 xl12(unsigned xlfn, ARGS ... args) {
   auto count = sizeof ... (ARGS);
   CXLOPER12 xRet;
-  Excel12(xlfn,&xRet,count,args...);
+  auto ret = Excel12(xlfn,&xRet,count,args...);
+  if (xltrace::active) {
+    LPXLOPER12 argv[] = {args...,nullptr};
+    xltrace::callback(xlfn,ret,count,argv,&xRet);
+  }
   return xRet;
 }
 
@@ -447,7 +833,676 @@ struct xll {
     delete utf8str;
     return tmp;
   }
+  // straight from utf16, e.g. CXLOPER12::view(), a single allocation
+  static std::string to_utf8(std::wstring_view str) {
+    std::string ret;
+    if (str.empty()) return ret;
+    auto len = WideCharToMultiByte(CP_UTF8,0,str.data(),(int)str.size(),nullptr,0,nullptr,nullptr);
+    ret.resize(len);
+    WideCharToMultiByte(CP_UTF8,0,str.data(),(int)str.size(),ret.data(),len,nullptr,nullptr);
+    return ret;
+  }
+  /*
+  Excel collation
+    numbers < text < bools < errors < nil/missing
+    Int and Num compare as numbers, text as CompareStringEx does with the 
+    user locale ignoring case, through its sort key.
+  key() builds a cell's collation key once, sorting and hashing many cells 
+  should compare keys rather than cells.
+  */
+  struct collkey {
+    int rank = 4;
+    double num = 0;   // numbers, bools and error codes
+    std::string text; // LCMapStringEx sort key
+  };
+  static int rank(CXLOPER12 &op) {
+    if (op.isNum() || op.isInt()) return 0;
+    if (op.isStr()) return 1;
+    if (op.isBool()) return 2;
+    if (op.isErr()) return 3;
+    return 4;
+  }
+  static double number(CXLOPER12 &op) {
+    return op.isInt() ? op.val.w : op.val.num;
+  }
+  static collkey key(CXLOPER12 &op) {
+    collkey k;
+    k.rank = rank(op);
+    switch(k.rank) {
+      case 0: {
+        k.num = number(op);
+        if (k.num == 0) k.num = 0; // fold -0.0
+        break;
+      }
+      case 1: {
+        int len = op.val.str[0];
+        if (!len) break;
+        auto map = [&](int bytes) {
+          return LCMapStringEx(LOCALE_NAME_USER_DEFAULT,LCMAP_SORTKEY|NORM_IGNORECASE,
+            op.val.str+1,len,(LPWSTR)k.text.data(),bytes,nullptr,nullptr,0);
+        };
+        // usually fits, otherwise ask for the size
+        k.text.resize(4*len+16);
+        int bytes = map((int)k.text.size());
+        if (!bytes) {
+          k.text.resize(LCMapStringEx(LOCALE_NAME_USER_DEFAULT,LCMAP_SORTKEY|NORM_IGNORECASE,
+            op.val.str+1,len,nullptr,0,nullptr,nullptr,0));
+          bytes = map((int)k.text.size());
+        }
+        k.text.resize(bytes ? bytes-1 : 0); // drop the terminating null
+        break;
+      }
+      case 2: {
+        k.num = op.val.xbool ? 1 : 0;
+        break;
+      }
+      case 3: {
+        k.num = op.val.err;
+        break;
+      }
+    }
+    return k;
+  }
+  static int compare(collkey const &a, collkey const &b) {
+    if (a.rank != b.rank) return a.rank < b.rank ? -1 : 1;
+    if (a.rank == 1) {
+      auto ret = a.text.compare(b.text);
+      return ret < 0 ? -1 : (ret > 0 ? 1 : 0);
+    }
+    return a.num < b.num ? -1 : (a.num > b.num ? 1 : 0);
+  }
+  static int compare(CXLOPER12 &a, CXLOPER12 &b) {
+    return compare(key(a),key(b));
+  }
+  // FNV-1a, keys equal under compare() hash equal
+  static uint64_t hash(collkey const &k, uint64_t h = 14695981039346656037ull) {
+    auto mix = [&h](const void *p, size_t bytes) {
+      auto b = (const unsigned char*)p;
+      for(size_t i=0; i<bytes; i++) {
+        h ^= b[i];
+        h *= 1099511628211ull;
+      }
+    };
+    mix(&k.rank,sizeof(k.rank));
+    if (k.rank == 1) {
+      mix(k.text.data(),k.text.size());
+    } else {
+      mix(&k.num,sizeof(k.num));
+    }
+    return h;
+  }
+  static uint64_t hash(CXLOPER12 &op, uint64_t h = 14695981039346656037ull) {
+    return hash(key(op),h);
+  }
+};
+
+/*
+lookup index over one key column of a range or a Multi
+  lookup UDFs receive the same table on every call, a linear scan per call 
+  makes the total cost O(calls x rows). xlindex::get returns a cached index, 
+  lookups are then O(1) for exact match and O(log rows) for approximate match.
+  
+  register the table argument as U so the UDF gets the reference instead 
+  of the values, the cache is then keyed on sheet id and area, which is O(1) 
+  to check, and the key column is only coerced when the index is built. 
+  value() reads one cell of a matched row.
+  a Multi, e.g. an array constant or another UDF's result, is keyed on a 
+  fingerprint of its key column instead. that is a hash pass over the raw 
+  cells on every call, cheaper than a scan but still O(rows).
+  
+  the cache can't see cells change, so it is released when a recalc ends.
+  export a command and hook it once in xlAutoOpen
+    extern "C" __declspec(dllexport) int WINAPI xlindexClear() { xlindex::clear(); return 1; }
+    xlfRegisterEx("xlindexClear","J","xlindexClear","",2,"","","","");
+    xlindex::hook("xlindexClear");
+  at most capacity indexes are kept, least recently used first out.
+*/
+struct xlindex {
+  static inline size_t capacity = 16;
+  
+  // keys from column col of values, a scalar is a single key
+  xlindex(CXLOPER12 &values, COL col) : col(col) {
+    if (values.isMulti()) {
+      keys.reserve(values.val.array.rows);
+      for(RW r=1; r<=values.val.array.rows; r++) keys.push_back(xll::key(values.at(r,col)));
+    } else {
+      keys.push_back(xll::key(values));
+    }
+    size_t size = 16;
+    while(size < keys.size()*2) size <<= 1;
+    slots.assign(size,0);
+    hashes.resize(size);
+    for(RW r=1; r<=(RW)keys.size(); r++) {
+      auto h = xll::hash(keys[r-1]);
+      auto i = probe(keys[r-1],h);
+      if (!slots[i]) { // keep the first row of duplicated keys
+        slots[i] = r;
+        hashes[i] = h;
+      }
+    }
+  }
+  // exact match, 1-based row or 0 if not found
+  RW match(CXLOPER12 &key) {
+    auto k = xll::key(key);
+    return slots[probe(k,xll::hash(k))];
+  }
+  /*
+  approximate match, as VLOOKUP with TRUE
+    the largest key of the same type not greater than key, 0 if none.
+    the range needn't be sorted, the sorted order is built on first use.
+  */
+  RW match_sorted(CXLOPER12 &key) {
+    std::call_once(sorted,[&]{
+      order.resize(keys.size());
+      for(RW r=0; r<(RW)keys.size(); r++) order[r] = r+1;
+      std::stable_sort(order.begin(),order.end(),[&](RW a, RW b) {
+        return xll::compare(keys[a-1],keys[b-1]) < 0;
+      });
+    });
+    auto k = xll::key(key);
+    auto it = std::upper_bound(order.begin(),order.end(),k,[&](xll::collkey const &k, RW r) {
+      return xll::compare(k,keys[r-1]) < 0;
+    });
+    if (it == order.begin()) return 0;
+    RW r = *--it;
+    return keys[r-1].rank == k.rank ? r : 0;
+  }
+  // one cell of a referenced range, 1-based relative to the range, Nil for a Multi index
+  CXLOPER12 value(RW r, COL c) {
+    if (!byref) return CXLOPER12();
+    XLREF12 cell = {area.rwFirst+r-1,area.rwFirst+r-1,area.colFirst+c-1,area.colFirst+c-1};
+    auto op = ref(sheet,cell);
+    auto coerced = xl12(xlCoerce,&op);
+    auto ret = copy(coerced);
+    xlfree(coerced);
+    return ret;
+  }
+  /*
+  table is a Multi, a Ref with one area or an SRef on the calling sheet.
+  nullptr if it isn't one, col is out of range or a referenced column can't 
+  be coerced yet (uncalculated cells), Excel calls the UDF again later.
+  */
+  static std::shared_ptr<xlindex> get(CXLOPER12 &table, COL col) {
+    if (table.isMulti()) {
+      if (col<1 || col>table.val.array.columns) return nullptr;
+      auto fp = fingerprint(table,col);
+      auto rows = (size_t)table.val.array.rows;
+      return cached([&](xlindex &idx) {
+        return !idx.byref && idx.fp == fp && idx.col == col && idx.keys.size() == rows;
+      },[&]() {
+        auto idx = std::make_shared<xlindex>(table,col);
+        idx->fp = fp;
+        return idx;
+      });
+    }
+    IDSHEET sheet;
+    XLREF12 area;
+    if (!locate(table,sheet,area) || col<1 || col>area.colLast-area.colFirst+1)
+      return nullptr;
+    return cached([&](xlindex &idx) {
+      return idx.byref && idx.sheet == sheet && idx.col == col && !memcmp(&idx.area,&area,sizeof(area));
+    },[&]()->std::shared_ptr<xlindex> {
+      XLREF12 column = {area.rwFirst,area.rwLast,area.colFirst+col-1,area.colFirst+col-1};
+      auto op = ref(sheet,column);
+      CXLOPER12 type((int)xltypeMulti);
+      auto values = xl12(xlCoerce,&op,&type);
+      if (!values.isMulti()) {
+        xlfree(values);
+        return nullptr;
+      }
+      // the keys are copies, the coerced column goes back to Excel
+      auto idx = std::make_shared<xlindex>(values,1);
+      xlfree(values);
+      idx->byref = true;
+      idx->sheet = sheet;
+      idx->area = area;
+      idx->col = col;
+      return idx;
+    });
+  }
+  // raw content of the key column, no collation, so it stays cheap
+  static uint64_t fingerprint(CXLOPER12 &table, COL col) {
+    uint64_t h = 14695981039346656037ull;
+    auto mix = [&h](const void *p, size_t bytes) {
+      auto b = (const unsigned char*)p;
+      for(size_t i=0; i<bytes; i++) {
+        h ^= b[i];
+        h *= 1099511628211ull;
+      }
+    };
+    mix(&table.val.array.rows,sizeof(RW));
+    mix(&col,sizeof(col));
+    for(RW r=1; r<=table.val.array.rows; r++) {
+      auto &cell = table.at(r,col);
+      auto type = cell.xltype & 0xFFF;
+      mix(&type,sizeof(type));
+      if (cell.isStr()) {
+        mix(cell.val.str,sizeof(XCHAR)*(1+(uint16_t)cell.val.str[0]));
+      } else if (cell.isNum() || cell.isInt() || cell.isBool() || cell.isErr()) {
+        mix(&cell.val,cell.isNum() ? sizeof(double) : sizeof(int));
+      }
+    }
+    return h;
+  }
+  // release all cached indexes
+  static void clear() {
+    std::lock_guard guard(lock);
+    cache.clear();
+  }
+  // run command, an exported and registered macro calling clear(), when a recalc ends or is canceled
+  static void hook(const char *command) {
+    auto ended = xl12x(xlEventRegister,command,(int)xleventCalculationEnded);
+    auto canceled = xl12x(xlEventRegister,command,(int)xleventCalculationCanceled);
+  }
+private:
+  // look up with same, or build outside the lock and insert unless another thread beat us
+  static std::shared_ptr<xlindex> cached(std::function<bool(xlindex&)> same, std::function<std::shared_ptr<xlindex>()> build) {
+    auto find = [&]()->std::shared_ptr<xlindex> {
+      for(auto it=cache.begin(); it!=cache.end(); it++) {
+        if (same(**it)) {
+          cache.splice(cache.begin(),cache,it);
+          return cache.front();
+        }
+      }
+      return nullptr;
+    };
+    {
+      std::lock_guard guard(lock);
+      if (auto idx = find()) return idx;
+    }
+    auto idx = build();
+    if (!idx) return nullptr;
+    std::lock_guard guard(lock);
+    if (auto other = find()) return other;
+    cache.push_front(idx);
+    while(cache.size() > capacity) cache.pop_back();
+    return idx;
+  }
+  static bool locate(CXLOPER12 &ref, IDSHEET &sheet, XLREF12 &area) {
+    if (ref.isRef()) {
+      if (!ref.val.mref.lpmref || ref.val.mref.lpmref->count != 1) return false;
+      sheet = ref.val.mref.idSheet;
+      area = ref.val.mref.lpmref->reftbl[0];
+      return true;
+    }
+    if (ref.isSRef()) {
+      // an SRef is on the sheet being calculated
+      auto name = xl12(xlSheetNm,&ref);
+      auto id = xl12(xlSheetId,&name);
+      bool found = id.isRef();
+      if (found) {
+        sheet = id.val.mref.idSheet;
+        area = ref.val.sref.ref;
+      }
+      xlfree(name);
+      xlfree(id);
+      return found;
+    }
+    return false;
+  }
+  // Excel allocated op, hand it back with xlFree rather than std::free in the dtor
+  static void xlfree(CXLOPER12 &op) {
+    Excel12(xlFree,nullptr,1,&op);
+    op.xltype = xltypeNil;
+  }
+  static CXLOPER12 ref(IDSHEET sheet, XLREF12 const &area) {
+    CXLOPER12 ret;
+    auto lpmref = (XLMREF12*)CXLOPER12::allocate(sizeof(XLMREF12));
+    lpmref->count = 1;
+    lpmref->reftbl[0] = area;
+    ret.xltype = xltypeRef;
+    ret.val.mref.idSheet = sheet;
+    ret.val.mref.lpmref = lpmref;
+    return ret;
+  }
+  // value() outlives the coerced cell, strings are copied
+  static CXLOPER12 copy(CXLOPER12 &op) {
+    if (op.isNum()) return CXLOPER12(op.val.num);
+    if (op.isInt()) return CXLOPER12((int)op.val.w);
+    if (op.isBool()) return CXLOPER12(op.val.xbool != 0);
+    if (op.isErr()) return CXLOPER12((xltypeErrEx)op.val.err);
+    if (op.isStr()) return CXLOPER12(op.view());
+    return CXLOPER12();
+  }
+  size_t probe(xll::collkey const &key, uint64_t h) {
+    auto mask = slots.size()-1;
+    auto i = h & mask;
+    while(slots[i] && (hashes[i] != h || xll::compare(keys[slots[i]-1],key) != 0)) {
+      i = (i+1) & mask;
+    }
+    return i;
+  }
+  bool byref = false;
+  IDSHEET sheet = 0;
+  XLREF12 area = {};
+  uint64_t fp = 0;
+  COL col;
+  std::vector<xll::collkey> keys;
+  std::vector<RW> slots; // open addressing, 0 is empty
+  std::vector<uint64_t> hashes;
+  std::vector<RW> order;
+  std::once_flag sorted;
+  static inline std::mutex lock;
+  static inline std::list<std::shared_ptr<xlindex>> cache;
+};
+/*
+row kernels on Multi
+  rows are reordered or dropped in place, cells are moved bitwise so 
+  strings and nested arrays are never copied. sort/unique/filter first 
+  compute a list of row numbers and then apply it with permute/keep.
+  ordering and unique's equality follow xll::compare, text that differs 
+  only in case counts as the same. collation keys are built once per cell 
+  before sorting. blank cells sort last in either direction, as in Excel.
+*/
+struct xlrows {
+  struct key {
+    COL col;
+    bool ascending = true;
+  };
+  // stable multi-key sort
+  static void sort(CXLOPER12 &table, std::vector<key> const &keys) {
+    if (!table.isMulti()) return;
+    for(auto &k : keys) {
+      if (k.col<1 || k.col>table.val.array.columns) return;
+    }
+    auto order = rows(table);
+    auto ks = collate(table,keys.size(),[&](size_t i) { return keys[i].col; });
+    std::stable_sort(order.begin(),order.end(),[&](RW a, RW b) {
+      for(size_t i=0; i<keys.size(); i++) {
+        auto &x = ks[i][a-1], &y = ks[i][b-1];
+        if (x.rank == 4 || y.rank == 4) {
+          if (x.rank != y.rank) return y.rank == 4;
+          continue;
+        }
+        auto ret = xll::compare(x,y);
+        if (ret) return keys[i].ascending ? ret < 0 : ret > 0;
+      }
+      return false;
+    });
+    permute(table,order);
+  }
+  // keep the first row of each distinct combination of cols, all columns if cols is empty
+  static void unique(CXLOPER12 &table, std::vector<COL> cols = {}) {
+    if (!table.isMulti()) return;
+    if (cols.empty()) {
+      for(COL c=1; c<=table.val.array.columns; c++) cols.push_back(c);
+    }
+    for(auto c : cols) {
+      if (c<1 || c>table.val.array.columns) return;
+    }
+    auto ks = collate(table,cols.size(),[&](size_t i) { return cols[i]; });
+    auto equal = [&](RW a, RW b) {
+      for(auto &k : ks) {
+        if (xll::compare(k[a-1],k[b-1])) return false;
+      }
+      return true;
+    };
+    RW n = table.val.array.rows;
+    size_t size = 16;
+    while(size < (size_t)n*2) size <<= 1;
+    std::vector<RW> slots(size,0);
+    std::vector<uint64_t> hashes(size);
+    std::vector<RW> kept;
+    for(RW r=1; r<=n; r++) {
+      uint64_t h = 14695981039346656037ull;
+      for(auto &k : ks) h = xll::hash(k[r-1],h);
+      auto i = h & (size-1);
+      while(slots[i] && (hashes[i] != h || !equal(slots[i],r))) i = (i+1) & (size-1);
+      if (!slots[i]) {
+        slots[i] = r;
+        hashes[i] = h;
+        kept.push_back(r);
+      }
+    }
+    keep(table,kept);
+  }
+  // keep rows for which fn returns true
+  static void filter(CXLOPER12 &table, std::function<bool(RW,CXLOPER12&)> fn) {
+    if (!table.isMulti()) return;
+    std::vector<RW> kept;
+    for(RW r=1; r<=table.val.array.rows; r++) {
+      if (fn(r,table)) kept.push_back(r);
+    }
+    keep(table,kept);
+  }
+  // row i of the result is row order[i-1] of the input, order is a permutation of 1..rows
+  static void permute(CXLOPER12 &table, std::vector<RW> const &order) {
+    auto cols = table.val.array.columns;
+    auto bytes = sizeof(XLOPER12)*cols;
+    std::vector<XLOPER12> tmp(cols);
+    std::vector<bool> done(order.size());
+    for(size_t i=0; i<order.size(); i++) {
+      if (done[i] || order[i] == (RW)i+1) continue;
+      // follow the cycle through i
+      memcpy(tmp.data(),row(table,i+1),bytes);
+      size_t j = i;
+      while((size_t)order[j]-1 != i) {
+        memcpy(row(table,j+1),row(table,order[j]),bytes);
+        done[j] = true;
+        j = order[j]-1;
+      }
+      memcpy(row(table,j+1),tmp.data(),bytes);
+      done[j] = true;
+    }
+  }
+  /*
+  keep the given rows, in ascending order, and destroy the others.
+  a table with no rows left becomes #N/A since Excel has no empty Multi.
+  */
+  static void keep(CXLOPER12 &table, std::vector<RW> const &kept) {
+    auto cols = table.val.array.columns;
+    auto bytes = sizeof(XLOPER12)*cols;
+    RW n = table.val.array.rows, next = 0;
+    for(RW r=1; r<=n; r++) {
+      if (next < (RW)kept.size() && kept[next] == r) {
+        if (next+1 != r) memcpy(row(table,next+1),row(table,r),bytes);
+        next++;
+      } else {
+        for(COL c=1; c<=cols; c++) cell(table,r,c).~CXLOPER12();
+      }
+    }
+    table.val.array.rows = next;
+    if (!next) table = CXLOPER12(xltypeErrEx::NA);
+  }
+private:
+  // collation keys of n columns, col(i) gives the i-th
+  static std::vector<std::vector<xll::collkey>> collate(CXLOPER12 &table, size_t n, std::function<COL(size_t)> col) {
+    std::vector<std::vector<xll::collkey>> ks(n);
+    for(size_t i=0; i<n; i++) {
+      ks[i].reserve(table.val.array.rows);
+      for(RW r=1; r<=table.val.array.rows; r++) ks[i].push_back(xll::key(cell(table,r,col(i))));
+    }
+    return ks;
+  }
+  static std::vector<RW> rows(CXLOPER12 &table) {
+    std::vector<RW> order(table.val.array.rows);
+    for(RW r=0; r<table.val.array.rows; r++) order[r] = r+1;
+    return order;
+  }
+  // unchecked, 1-based
+  static XLOPER12* row(CXLOPER12 &table, RW r) {
+    return table.val.array.lparray + (size_t)(r-1)*table.val.array.columns;
+  }
+  static CXLOPER12& cell(CXLOPER12 &table, RW r, COL c) {
+    return (CXLOPER12&)row(table,r)[c-1];
+  }
+};
+
+/*
+shape operations on Multi
+  sources are taken by rvalue and their cells are moved bitwise into the 
+  result, strings and nested arrays are never copied. scalars act as 1x1.
+  transpose walks the array in tiles so both source and destination stay 
+  in cache, very large arrays are split across threads by tile rows.
+  Excel's calc threads are already busy during a multi-threaded recalc, 
+  so at most max_threads are used, the calling thread included, 1 never 
+  starts a thread.
+*/
+struct xlarray {
+  static inline RW tile = 16; // 16x16 cells, 8KB per side
+  static inline size_t parallel_cells = 1<<20;
+  static inline unsigned max_threads = 4;
+  
+  static CXLOPER12 transpose(CXLOPER12 &&src) {
+    if (!src.isMulti()) return std::move(src);
+    RW rows = src.val.array.rows;
+    COL cols = src.val.array.columns;
+    CXLOPER12 ret;
+    ret.uninit(cols,rows);
+    auto from = src.val.array.lparray, to = ret.val.array.lparray;
+    auto band = [=](RW r0, RW r1) {
+      for(RW rt=r0; rt<r1; rt+=tile) {
+        for(COL ct=0; ct<cols; ct+=tile) {
+          RW re = std::min<RW>(rt+tile,r1);
+          COL ce = std::min<COL>(ct+tile,cols);
+          for(RW r=rt; r<re; r++) {
+            for(COL c=ct; c<ce; c++) {
+              to[(size_t)c*rows+r] = from[(size_t)r*cols+c];
+            }
+          }
+        }
+      }
+    };
+    size_t cells = (size_t)rows*cols;
+    unsigned n = std::min(std::thread::hardware_concurrency(),max_threads);
+    if (cells < parallel_cells || n < 2) {
+      band(0,rows);
+    } else {
+      // whole tiles per thread, the last band runs here, jthread joins the others
+      RW tiles = (rows+tile-1)/tile;
+      RW per = (tiles+n-1)/n*tile;
+      std::vector<std::jthread> threads;
+      RW r = 0;
+      try {
+        for(; r+per<rows; r+=per) threads.emplace_back(band,r,r+per);
+      } catch(std::system_error&) {
+        // no more threads, the rest runs here
+      }
+      band(r,rows);
+    }
+    relinquish(src);
+    return ret;
+  }
+  // row-major order is kept, only the dimensions change, #VALUE! if the cell counts differ
+  static CXLOPER12 reshape(CXLOPER12 &&src, RW rows, COL cols) {
+    auto [r,c] = dims(src);
+    if (rows<1 || cols<1 || (size_t)rows*cols != (size_t)r*c) 
+      return CXLOPER12(xltypeErrEx::VALUE);
+    if (!src.isMulti()) {
+      CXLOPER12 ret;
+      ret.uninit(1,1);
+      *ret.val.array.lparray = *cells(src);
+      relinquish(src);
+      return ret;
+    }
+    src.val.array.rows = rows;
+    src.val.array.columns = cols;
+    return std::move(src);
+  }
+  // sub-block of rows x cols at (r,c), 1-based, #REF! if it doesn't fit
+  static CXLOPER12 slice(CXLOPER12 &&src, RW r, COL c, RW rows, COL cols) {
+    auto [nr,nc] = dims(src);
+    if (r<1 || c<1 || rows<1 || cols<1 || r+rows-1 > nr || c+cols-1 > nc)
+      return CXLOPER12(xltypeErrEx::REF);
+    CXLOPER12 ret;
+    ret.uninit(rows,cols);
+    auto from = cells(src);
+    for(RW i=0; i<nr; i++) {
+      for(COL j=0; j<nc; j++) {
+        auto &cell = from[(size_t)i*nc+j];
+        if (i+1>=r && i+1<r+rows && j+1>=c && j+1<c+cols) {
+          ret.val.array.lparray[(size_t)(i+1-r)*cols+(j+1-c)] = cell;
+          cell.xltype = xltypeNil;
+        }
+      }
+    }
+    // moved cells are Nil now, freeing the source drops only the rest
+    src = CXLOPER12();
+    return ret;
+  }
+  // as Excel VSTACK, narrower parts are padded with #N/A
+  template<typename ... ARGS>
+  requires (sizeof ... (ARGS) > 0 && std::conjunction_v<std::is_same<ARGS,CXLOPER12>...>)
+  static CXLOPER12 vstack(ARGS&& ... args) {
+    CXLOPER12 *parts[] = {std::addressof(args)...};
+    size_t rows = 0, cols = 0;
+    for(auto p : parts) {
+      auto [r,c] = dims(*p);
+      rows += r;
+      cols = std::max<size_t>(cols,c);
+    }
+    CXLOPER12 ret;
+    if (!ret.uninit(rows,cols)) return ret;
+    size_t at = 0;
+    for(auto p : parts) {
+      auto [r,c] = dims(*p);
+      for(RW i=0; i<r; i++) {
+        auto to = ret.val.array.lparray + (at+i)*cols;
+        memcpy(to,cells(*p)+(size_t)i*c,sizeof(XLOPER12)*c);
+        for(size_t j=c; j<cols; j++) na(to[j]);
+      }
+      at += r;
+      relinquish(*p);
+    }
+    return ret;
+  }
+  // as Excel HSTACK, shorter parts are padded with #N/A
+  template<typename ... ARGS>
+  requires (sizeof ... (ARGS) > 0 && std::conjunction_v<std::is_same<ARGS,CXLOPER12>...>)
+  static CXLOPER12 hstack(ARGS&& ... args) {
+    CXLOPER12 *parts[] = {std::addressof(args)...};
+    size_t rows = 0, cols = 0;
+    for(auto p : parts) {
+      auto [r,c] = dims(*p);
+      rows = std::max<size_t>(rows,r);
+      cols += c;
+    }
+    CXLOPER12 ret;
+    if (!ret.uninit(rows,cols)) return ret;
+    size_t at = 0;
+    for(auto p : parts) {
+      auto [r,c] = dims(*p);
+      for(size_t i=0; i<rows; i++) {
+        auto to = ret.val.array.lparray + i*cols + at;
+        if (i < (size_t)r) {
+          memcpy(to,cells(*p)+i*c,sizeof(XLOPER12)*c);
+        } else {
+          for(COL j=0; j<c; j++) na(to[j]);
+        }
+      }
+      at += c;
+      relinquish(*p);
+    }
+    return ret;
+  }
+private:
+  // padding, the cell is already counted by CXLOPER12::uninit
+  static void na(XLOPER12 &cell) {
+    cell.xltype = xltypeErr;
+    cell.val.err = xlerrNA;
+  }
+  static std::pair<RW,COL> dims(CXLOPER12 &op) {
+    if (op.isMulti()) return {op.val.array.rows,op.val.array.columns};
+    return {1,1};
+  }
+  static XLOPER12* cells(CXLOPER12 &op) {
+    return op.isMulti() ? op.val.array.lparray : static_cast<XLOPER12*>(std::addressof(op));
+  }
+  /*
+  the cells now live in a result whose uninit counted them, drop the 
+  source without destroying them. unlike CXLOPER12::release nothing is 
+  handed to the caller.
+  */
+  static void relinquish(CXLOPER12 &op) {
+    if (op.isMulti()) {
+      CXLOPER12::alloc -= op.val.array.rows*op.val.array.columns;
+      op.val.array.rows = 0;
+    } else {
+      op.xltype = xltypeNil;
+    }
+  }
 };
+
 // undocumented commands
 
 #define xlcSetRec           (18 | xlCommand)
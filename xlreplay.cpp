@@ -0,0 +1,261 @@
+#include "windows.h"
+#include "xlcallex.h"
+#include <thread>
+#include <unordered_map>
+#include <utility>
+/*
+replay a trace recorded with xltrace against an XLL, this process stands in for Excel
+cl /nologo /std:c++latest /O2 /MD /EHsc /Zc:strictStrings- /ID:\excel2013sdk\include xlreplay.cpp xlcallex.cpp /link /out:xlreplay.exe user32.lib
+
+xlreplay <xll> <trace> [threads=1] [repeat=1] [pace=0]
+  threads  concurrent callers of the UDFs, 1 to 1024
+  repeat   times the UDF calls of the trace are replayed
+  pace     0 calls as fast as possible, otherwise scales the recorded call times, 
+           1 is recorded speed, 0.5 twice as fast
+  
+  the XLL's Excel12 finds MdCallBack12 exported by this process, every callback 
+  gets the result recorded for the same function and arguments, #N/A otherwise.
+  results are handed over in std::malloc'ed buffers, so build the XLL with /MD too.
+  xlFree frees and resets its arguments.
+  UDFs are called with LPXLOPER12 arguments only, as registered with Q.
+  allocations are the std::malloc'ed or adopted CXLOPER12 buffers in the XLL, 
+  counted only when it is built with /DXLLUTL_COUNT_ALLOCS.
+  on Linux run it under Wine.
+*/
+
+struct record {
+  uint64_t t;
+  std::string name;
+  uint16_t argc;
+  std::string args; // serialized
+  FARPROC fn;
+};
+static std::vector<record> udfs;
+// xlfn and serialized args -> return code, serialized result
+static std::unordered_map<std::string,std::pair<int,std::string>> answers;
+
+extern "C" __declspec(dllexport)
+int PASCAL MdCallBack12(int xlfn, int coper, LPXLOPER12 *rgpxloper12, LPXLOPER12 xloper12Res) {
+  if (xlfn == xlFree) {
+    // results were std::malloc'ed here, free and reset them as Excel would
+    for(int i=0; i<coper; i++) CXLOPER12::attach(rgpxloper12[i]) = CXLOPER12();
+    return xlretSuccess;
+  }
+  std::string key;
+  xltrace::put<int32_t>(key,xlfn);
+  for(int i=0; i<coper; i++) xltrace::write(key,rgpxloper12[i]);
+  auto it = answers.find(key);
+  if (it == answers.end()) {
+    if (xloper12Res) *xloper12Res = CXLOPER12(xltypeErrEx::NA).release();
+    return xlretFailed;
+  }
+  if (xloper12Res) {
+    const char *p = it->second.second.data();
+    *xloper12Res = xltrace::read(p).release();
+  }
+  return it->second.first;
+}
+
+static bool load(const char *path) {
+  auto file = fopen(path,"rb");
+  if (!file) return false;
+  std::string buf;
+  char chunk[1<<16];
+  size_t n;
+  while((n = fread(chunk,1,sizeof(chunk),file)) > 0) buf.append(chunk,n);
+  fclose(file);
+  
+  // a trace cut off mid-record is normal when Excel dies before xltrace::close
+  const char *p = buf.data(), *end = buf.data()+buf.size();
+  size_t records = 0, bad = 0;
+  while(p < end) {
+    if (end-p < 5) break;
+    auto kind = xltrace::get<uint8_t>(p);
+    auto bytes = xltrace::get<uint32_t>(p);
+    if (bytes > (size_t)(end-p)) break;
+    auto next = p+bytes;
+    auto fits = [&](size_t n) { return n <= (size_t)(next-p); };
+    auto values = [&](int count) {
+      for(int i=0; i<count; i++) {
+        if (!xltrace::skip(p,next)) return false;
+      }
+      return true;
+    };
+    records++;
+    if (!fits(sizeof(uint64_t))) {
+      bad++;
+      p = next;
+      continue;
+    }
+    auto t = xltrace::get<uint64_t>(p);
+    if (kind == xltrace::EXCEL) {
+      std::string key;
+      if (fits(2*sizeof(int32_t)+sizeof(uint16_t))) {
+        xltrace::put<int32_t>(key,xltrace::get<int32_t>(p));
+        auto ret = xltrace::get<int32_t>(p);
+        auto argc = xltrace::get<uint16_t>(p);
+        auto args = p;
+        if (values(argc)) {
+          key.append(args,p);
+          auto result = p;
+          if (values(1)) {
+            answers[key] = {ret,std::string(result,p)};
+            p = next;
+            continue;
+          }
+        }
+      }
+      bad++;
+    } else if (kind == xltrace::UDF) {
+      record rec;
+      rec.t = t;
+      if (fits(sizeof(uint16_t))) {
+        auto len = xltrace::get<uint16_t>(p);
+        if (fits(len+sizeof(uint16_t))) {
+          rec.name.assign(p,len);
+          p += len;
+          rec.argc = xltrace::get<uint16_t>(p);
+          auto args = p;
+          if (values(rec.argc)) {
+            rec.args.assign(args,p);
+            udfs.push_back(std::move(rec));
+            p = next;
+            continue;
+          }
+        }
+      }
+      bad++;
+    }
+    p = next;
+  }
+  if (p < end) printf("trace truncated after %zu records\n",records);
+  if (bad) printf("%zu malformed records skipped\n",bad);
+  return true;
+}
+
+// whole number in [lo,hi]
+static bool parse(const char *str, long long lo, long long hi, long long &v) {
+  char *e;
+  v = strtoll(str,&e,10);
+  return e != str && !*e && v >= lo && v <= hi;
+}
+
+// UDFs take a fixed number of LPXLOPER12, one trampoline per count
+constexpr size_t MAXARGS = 32;
+
+template<size_t ... I>
+static LPXLOPER12 invoke(FARPROC fn, LPXLOPER12 *args, std::index_sequence<I...>) {
+  using UDF = LPXLOPER12 (WINAPI*)(decltype((void)I,LPXLOPER12())...);
+  return ((UDF)fn)(args[I]...);
+}
+template<size_t N>
+static LPXLOPER12 call(FARPROC fn, LPXLOPER12 *args) {
+  return invoke(fn,args,std::make_index_sequence<N>());
+}
+template<size_t ... N>
+static auto trampolines(std::index_sequence<N...>) {
+  return std::array<LPXLOPER12(*)(FARPROC,LPXLOPER12*),sizeof ... (N)>{&call<N>...};
+}
+
+int main(int argc, char **argv) {
+  long long threads = 1, repeat = 1;
+  double pace = 0;
+  char *e = nullptr;
+  if (argc < 3 || argc > 6 ||
+      (argc > 3 && !parse(argv[3],1,1024,threads)) ||
+      (argc > 4 && !parse(argv[4],1,1ll<<40,repeat)) ||
+      (argc > 5 && ((pace = strtod(argv[5],&e)), e == argv[5] || *e || !(pace >= 0)))) {
+    printf("xlreplay <xll> <trace> [threads=1..1024] [repeat>=1] [pace>=0]\n");
+    return 1;
+  }
+  
+  if (!load(argv[2])) {
+    printf("can't read %s\n",argv[2]);
+    return 1;
+  }
+  auto xll = LoadLibraryA(argv[1]);
+  if (!xll) {
+    printf("can't load %s\n",argv[1]);
+    return 1;
+  }
+  auto autoOpen = (int(WINAPI*)())GetProcAddress(xll,"xlAutoOpen");
+  auto autoFree = (void(WINAPI*)(LPXLOPER12))GetProcAddress(xll,"xlAutoFree12");
+  auto traceAlloc = (uint64_t(*)())GetProcAddress(xll,"xlTraceAlloc");
+  if (autoOpen) autoOpen();
+  
+  std::vector<record> calls;
+  for(auto &rec : udfs) {
+    rec.fn = GetProcAddress(xll,rec.name.c_str());
+    if (!rec.fn || rec.argc > MAXARGS) {
+      printf("skip %s\n",rec.name.c_str());
+      continue;
+    }
+    calls.push_back(std::move(rec));
+  }
+  if (calls.empty()) {
+    printf("no UDF calls to replay\n");
+    return 1;
+  }
+  if ((size_t)repeat > SIZE_MAX/calls.size()) {
+    printf("repeat too large\n");
+    return 1;
+  }
+  
+  static auto udf = trampolines(std::make_index_sequence<MAXARGS+1>());
+  using clock = std::chrono::steady_clock;
+  // min and max rather than front and back, don't trust the file order
+  auto [first,last] = std::minmax_element(calls.begin(),calls.end(),[](record &a, record &b) {
+    return a.t < b.t;
+  });
+  uint64_t t0 = first->t, span = last->t - t0 + 1;
+  size_t total = calls.size()*repeat;
+  std::atomic<size_t> next = 0;
+  std::vector<std::vector<uint64_t>> latency(threads);
+  uint64_t allocs = traceAlloc ? traceAlloc() : 0;
+  auto start = clock::now();
+  
+  auto worker = [&](unsigned id) {
+    auto &lat = latency[id];
+    for(size_t i; (i = next++) < total;) {
+      auto &rec = calls[i%calls.size()];
+      if (pace > 0) {
+        auto due = (i/calls.size())*span + rec.t - t0;
+        std::this_thread::sleep_until(start + std::chrono::nanoseconds((uint64_t)(due*pace)));
+      }
+      std::vector<CXLOPER12> args;
+      args.reserve(rec.argc);
+      LPXLOPER12 argp[MAXARGS+1];
+      const char *p = rec.args.data();
+      for(int a=0; a<rec.argc; a++) {
+        args.push_back(xltrace::read(p));
+        argp[a] = &args.back();
+      }
+      auto t = clock::now();
+      auto ret = udf[rec.argc](rec.fn,argp);
+      lat.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now()-t).count());
+      if (ret && (ret->xltype & xlbitDLLFree) && autoFree) autoFree(ret);
+    }
+  };
+  std::vector<std::thread> pool;
+  for(unsigned id=0; id<threads; id++) pool.emplace_back(worker,id);
+  for(auto &t : pool) t.join();
+  double secs = std::chrono::duration<double>(clock::now()-start).count();
+  
+  std::vector<uint64_t> all;
+  for(auto &lat : latency) all.insert(all.end(),lat.begin(),lat.end());
+  std::sort(all.begin(),all.end());
+  auto pct = [&](double p) {
+    return all[std::min(all.size()-1,(size_t)(p*all.size()))]/1000.0;
+  };
+  printf("calls      %zu on %lld threads in %.3fs\n",all.size(),threads,secs);
+  printf("throughput %.1f calls/s\n",all.size()/secs);
+  printf("latency us p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+    pct(0.5),pct(0.9),pct(0.99),pct(0.999),all.back()/1000.0);
+  if (traceAlloc) {
+    allocs = traceAlloc() - allocs;
+    printf("CXLOPER12 buffers allocated %llu, %.1f per call\n",(unsigned long long)allocs,(double)allocs/all.size());
+  } else {
+    printf("CXLOPER12 buffers not counted, build the XLL with /DXLLUTL_COUNT_ALLOCS\n");
+  }
+  return 0;
+}